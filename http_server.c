@@ -1,8 +1,16 @@
+#define _GNU_SOURCE
 #include "http_server.h"
 #include "log.h"
 #include <assert.h>
 #include <dirent.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
 #include <time.h>
 
 #define STRINGS_MATCH 0
@@ -38,7 +46,34 @@
 #define CONNECT_ERROR -37
 #define SENT_COMPLETE 0
 #define ZERO_RESET_INIT_VALUE 0
-
+#define NO_CPU_SELECTED -1
+#define NO_BUSY_POLL 0
+#define SOCKET_OPTION_ERROR -38
+#define INCOMING_CPU_REUSEPORT_MAJOR 6
+#define INCOMING_CPU_REUSEPORT_MINOR 2
+
+// Placement options picked up by http_server_parse_arguments and applied in
+// http_server_create. They live here instead of in Config so the options only
+// touch this file.
+static int selectedCpu = NO_CPU_SELECTED;
+static bool numaLocal = false;
+static int busyPollMicros = NO_BUSY_POLL;
+// Set when the listener lacks SO_BUSY_POLL, so accepted sockets do not inherit
+// it and need it set one by one.
+static bool clientBusyPoll = false;
+
+// Parses a non-negative decimal option value. Returns -1 if the text is not a
+// number or does not fit in an int.
+static int http_server_parse_count(const char *text) {
+  char *end = NULL;
+  errno = ZERO_VALUE;
+  long value = strtol(text, &end, 10);
+  if (end == text || *end != NULL_TERMINATOR || errno != ZERO_VALUE ||
+      value < ZERO_VALUE || value > INT_MAX) {
+    return -1;
+  }
+  return (int)value;
+}
 
 // Parses the options given to the program. It will return a Config struct with
 // the necessary information filled in. argc and argv are provided by main. If
@@ -49,7 +84,6 @@ Config http_server_parse_arguments(int argc, char *argv[]) {
   Config myConfig;
   myConfig.port = "invalid";
   myConfig.relative_path = "invalid";
-  bool stillParsing = true;
   int selectedOption = 0;
   int optionIndex = 0;
   bool portReceived = false;
@@ -59,52 +93,74 @@ Config http_server_parse_arguments(int argc, char *argv[]) {
                                {"verbose", no_argument, 0, 'v'},
                                {"port", required_argument, 0, 'p'},
                                {"folder", required_argument, 0, 'f'},
+                               {"cpu", required_argument, 0, 'c'},
+                               {"numa", no_argument, 0, 'n'},
+                               {"busy-poll", required_argument, 0, 'b'},
                                {0, 0, 0, 0}};
 
-  while ((selectedOption = getopt_long(argc, argv, ":hvp:f:", long_opts,
+  while ((selectedOption = getopt_long(argc, argv, ":hvp:f:c:nb:", long_opts,
                                        &optionIndex)) != -1) {
-
-    while (stillParsing) {
-      switch (selectedOption) {
-      case 0:
-        // printUsage();
-        break;
-      case 'h':
-        log_trace("Providing help information");
+    switch (selectedOption) {
+    case 0:
+      // printUsage();
+      break;
+    case 'h':
+      log_trace("Providing help information");
+      myConfig.port = "invalid";
+      myConfig.relative_path = "invalid";
+      return myConfig;
+      break;
+    case 'v':
+      log_set_quiet(false);
+      log_trace("Verbose flag activated\n");
+      break;
+    case 'p':
+      log_trace("Port option chosen and now parsing parameter passed in");
+      myConfig.port = optarg;
+      portReceived = true;
+      break;
+    case 'f':
+      myConfig.relative_path = optarg;
+      log_trace("Folder option was chosen\n");
+      pathReceived = true;
+      DIR *dir = opendir(myConfig.relative_path);
+      if (!dir || errno == ENOTDIR) {
+        log_error("invlaid strating folder");
+        myConfig.port = "invalid";
+        myConfig.relative_path = "invalid";
+        return myConfig;
+      }
+      closedir(dir);
+      break;
+    case 'c':
+      log_trace("CPU option chosen, worker will be pinned to core %s",
+                optarg);
+      selectedCpu = http_server_parse_count(optarg);
+      if (selectedCpu < ZERO_VALUE || selectedCpu >= CPU_SETSIZE) {
+        log_error("invalid cpu %s", optarg);
+        myConfig.port = "invalid";
+        myConfig.relative_path = "invalid";
+        return myConfig;
+      }
+      break;
+    case 'n':
+      log_trace("NUMA local memory option chosen");
+      numaLocal = true;
+      break;
+    case 'b':
+      log_trace("Busy poll option chosen with %s microseconds", optarg);
+      busyPollMicros = http_server_parse_count(optarg);
+      if (busyPollMicros <= NO_BUSY_POLL) {
+        log_error("invalid busy poll time %s", optarg);
         myConfig.port = "invalid";
         myConfig.relative_path = "invalid";
         return myConfig;
-        break;
-      case 'v':
-        log_set_quiet(false);
-        log_trace("Verbose flag activated\n");
-        stillParsing = false;
-        break;
-      case 'p':
-        log_trace("Port option chosen and now parsing parameter passed in");
-        stillParsing = false;
-        myConfig.port = optarg;
-        portReceived = true;
-        break;
-      case 'f':
-        myConfig.relative_path = optarg;
-        log_trace("Folder option was chosen\n");
-        pathReceived = true;
-        stillParsing = false;
-        DIR *dir = opendir(myConfig.relative_path);
-        if (!dir || errno == ENOTDIR) {
-          log_error("invlaid strating folder");
-          myConfig.port = "invalid";
-          myConfig.relative_path = "invalid";
-          return myConfig;
-        }
-        closedir(dir);
-        break;
-      case '?':
-        break;
-      default:
-        printf("Unkonwn argument provided\n");
       }
+      break;
+    case '?':
+      break;
+    default:
+      printf("Unkonwn argument provided\n");
     }
   }
   // subtracting the options from the arguments to be left with th arguments
@@ -118,6 +174,11 @@ Config http_server_parse_arguments(int argc, char *argv[]) {
   if (!pathReceived) {
     myConfig.port = HTTP_SERVER_DEFAULT_RELATIVE_PATH;
   }
+  if (numaLocal && selectedCpu == NO_CPU_SELECTED) {
+    // printed like the usage text so it shows up without -v
+    printf("Warning: --numa without --cpu lets the worker move between "
+           "nodes, so memory is no more local than the kernel default\n");
+  }
   return myConfig;
 }
 
@@ -125,6 +186,119 @@ Config http_server_parse_arguments(int argc, char *argv[]) {
 ///////////// SOCKET RELATED FUNCTIONS /////////////
 ////////////////////////////////////////////////////
 
+// Pins the calling thread to selectedCpu and, if asked for, switches its
+// memory policy to the local node so buffers allocated for connections are
+// backed by memory next to that core. Has to run whether the listening socket
+// is created or taken over from an old server. Returns 0 on success and -1
+// otherwise.
+int http_server_apply_placement() {
+  if (selectedCpu != NO_CPU_SELECTED) {
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(selectedCpu, &cpuSet);
+    if (sched_setaffinity(ZERO_VALUE, sizeof(cpuSet), &cpuSet) != 0) {
+      log_error("Could not pin worker to cpu %d: %s", selectedCpu,
+                strerror(errno));
+      return -1;
+    }
+    log_info("Worker pinned to cpu %d\n", selectedCpu);
+  }
+
+  if (numaLocal) {
+    // set_mempolicy is called through syscall so libnuma is not needed
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, ZERO_VALUE) != 0) {
+      log_error("Could not set local NUMA memory policy: %s",
+                strerror(errno));
+      return -1;
+    }
+    log_info("Worker memory policy set to the local NUMA node\n");
+  }
+  return 0;
+}
+
+// Sets SO_BUSY_POLL on the listening socket. Accepted sockets inherit it from
+// there. Raising it needs CAP_NET_ADMIN, so without it the server keeps
+// running with interrupt driven receive and busy poll is turned off.
+static int http_server_apply_busy_poll(int sockfd) {
+  if (busyPollMicros > NO_BUSY_POLL) {
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busyPollMicros,
+                   sizeof(busyPollMicros)) != 0) {
+      log_warn("SO_BUSY_POLL failed, continuing without busy poll: %s",
+               strerror(errno));
+      busyPollMicros = NO_BUSY_POLL;
+    } else {
+      log_info("Busy poll enabled for %d microseconds\n", busyPollMicros);
+    }
+  }
+  return 0;
+}
+
+// Returns true if the running kernel picks a reuseport listener by its
+// SO_INCOMING_CPU value, which it does reliably from 6.2 on.
+static bool http_server_kernel_steers_by_cpu() {
+  struct utsname kernel;
+  int major = ZERO_VALUE;
+  int minor = ZERO_VALUE;
+  if (uname(&kernel) != ZERO_VALUE ||
+      sscanf(kernel.release, "%d.%d", &major, &minor) != TWO_VALUE) {
+    return false;
+  }
+  return major > INCOMING_CPU_REUSEPORT_MAJOR ||
+         (major == INCOMING_CPU_REUSEPORT_MAJOR &&
+          minor >= INCOMING_CPU_REUSEPORT_MINOR);
+}
+
+// Applies the steering and busy poll options to the listening socket. Has to
+// run before bind so SO_REUSEPORT puts the socket in the right group.
+static int http_server_steer_socket(int sockfd) {
+  int enable = ONE_VALUE;
+
+  if (selectedCpu != NO_CPU_SELECTED) {
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable,
+                   sizeof(enable)) != 0) {
+      log_error("SO_REUSEPORT failed: %s", strerror(errno));
+      return SOCKET_OPTION_ERROR;
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &selectedCpu,
+                   sizeof(selectedCpu)) != 0) {
+      log_error("SO_INCOMING_CPU failed: %s", strerror(errno));
+      return SOCKET_OPTION_ERROR;
+    }
+
+    // The kernel matches SO_INCOMING_CPU against the real cpu number, so any
+    // subset of cpus works and a member leaving does not move the others.
+    if (http_server_kernel_steers_by_cpu()) {
+      log_info("Listener steered to cpu %d by SO_INCOMING_CPU\n", selectedCpu);
+      return http_server_apply_busy_poll(sockfd);
+    }
+
+    // Older kernels need a program for the steering. It returns the cpu that
+    // received the packet as the slot in the reuseport group. Slots follow
+    // the order sockets joined the group, not --cpu, so this only keeps a
+    // connection on its RX core when the servers are started in cpu order
+    // (--cpu 0, then 1, 2 ...) and none of them leaves: closing a member
+    // moves the last socket into its slot. An out of range slot falls back
+    // to the normal reuseport hash.
+    struct sock_filter steerCode[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog steerProgram = {
+        .len = sizeof(steerCode) / sizeof(steerCode[0]),
+        .filter = steerCode,
+    };
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &steerProgram,
+                   sizeof(steerProgram)) != 0) {
+      log_error("Reuseport steering program failed: %s", strerror(errno));
+      return SOCKET_OPTION_ERROR;
+    }
+    log_info("Listener steered to cpu %d, servers must join in cpu order\n",
+             selectedCpu);
+  }
+
+  return http_server_apply_busy_poll(sockfd);
+}
+
 // Create and bind to a server socket using the provided configuration. A socket
 // file descriptor should be returned. If something fails, a -1 must be
 // returned.
@@ -142,6 +316,11 @@ int http_server_create(Config config) {
     return SERVER_CREATION_ERROR;
   } else
     log_info("Socket successfully created..\n");
+
+  if (http_server_steer_socket(sockfd) != 0) {
+    close(sockfd);
+    return SERVER_CREATION_ERROR;
+  }
   bzero(&servaddr, sizeof(servaddr));
 
   // assign IP, PORT
@@ -168,6 +347,45 @@ int http_server_create(Config config) {
   return sockfd;
 }
 
+// Checks a listening socket taken over from an old server against the options
+// given to this one. The port, steering and busy poll settings belong to the
+// socket and cannot change without rebinding it, so a mismatch is only
+// logged.
+void http_server_check_inherited(int socket, Config config) {
+  struct sockaddr_in boundAddr;
+  socklen_t addrLen = sizeof(boundAddr);
+  int requestedPort = atoi(config.port);
+  if (requestedPort > ZERO_VALUE &&
+      getsockname(socket, (struct sockaddr *)&boundAddr, &addrLen) ==
+          ZERO_VALUE &&
+      ntohs(boundAddr.sin_port) != requestedPort) {
+    log_warn("Inherited socket listens on port %d, ignoring port %d",
+             ntohs(boundAddr.sin_port), requestedPort);
+  }
+
+  int currentValue = ZERO_VALUE;
+  socklen_t valueLen = sizeof(currentValue);
+  if (selectedCpu != NO_CPU_SELECTED &&
+      (getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &currentValue,
+                  &valueLen) != ZERO_VALUE ||
+       currentValue != selectedCpu)) {
+    log_warn("Inherited socket is steered by the old server, --cpu %d only "
+             "pins this process",
+             selectedCpu);
+  }
+
+  valueLen = sizeof(currentValue);
+  if (busyPollMicros > NO_BUSY_POLL &&
+      (getsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &currentValue,
+                  &valueLen) != ZERO_VALUE ||
+       currentValue != busyPollMicros)) {
+    log_warn("Inherited socket keeps its busy poll setting, --busy-poll %d "
+             "only applies to new clients",
+             busyPollMicros);
+    clientBusyPoll = true;
+  }
+}
+
 // Listen on the provided server socket for incoming clients. When a client
 // connects, return the client socket file descriptor. This is a blocking call.
 // If an error occurs, return a -1.
@@ -217,6 +435,17 @@ int http_server_accept(int socket) {
   } else
     log_info("server acccept the client...\n");
 
+  // Client sockets inherit busy poll from the listener. Only a listener
+  // taken over without the option needs it set here, and a failure turns it
+  // off so it is not retried on every connection.
+  if (clientBusyPoll &&
+      setsockopt(finalSockfd, SOL_SOCKET, SO_BUSY_POLL, &busyPollMicros,
+                 sizeof(busyPollMicros)) != 0) {
+    log_warn("SO_BUSY_POLL on client failed, turning it off: %s",
+             strerror(errno));
+    clientBusyPoll = false;
+  }
+
   // server should be running and connected to a client on theis socket
   return finalSockfd; // FIX ME
 }
@@ -266,6 +495,11 @@ Request http_server_receive_request(int socket) {
         recv(socket, (dynamicBuffer + receivedAll),
              (startingSize - receivedAll), ZERO_RESET_INIT_VALUE);
 
+    // a signal interrupts recv even with SA_RESTART once SO_RCVTIMEO is set
+    if (charsReceived == -1 && errno == EINTR) {
+      continue;
+    }
+
     if (charsReceived == -1) {
       log_error("Read function had an error");
       free(dynamicBuffer);
@@ -589,10 +823,16 @@ Response http_server_process_request(Request request, char *relative_path) {
 }
 
 void printUsage() {
-  printf("Usage: http_server [--help] [-v] [-p PORT] [-f FOLDER]\n\n");
+  printf("Usage: http_server [--help] [-v] [-p PORT] [-f FOLDER] [-c CPU] "
+         "[-n] [-b USEC]\n\n");
   printf("Options:\n");
   printf("--help\n");
   printf("-v, --verbose\n");
   printf("--port PORT, -p PORT\n");
   printf("--folder FOLDER, -f FOLDER\n");
+  printf("--cpu CPU, -c CPU\n");
+  printf("--numa, -n\n");
+  printf("--busy-poll USEC, -b USEC (needs CAP_NET_ADMIN)\n\n");
+  printf("Set HTTP_SERVER_HANDOFF to a unix socket path for hot restart. Each\n");
+  printf("server started with a different --cpu needs its own path.\n");
 }
@@ -1,18 +1,284 @@
 #include "http_server.h"
 #include "log.h"
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 
 #define STRINGS_MATCH 0
+// Every server process needs its own handoff path. Servers started once per
+// core with --cpu would otherwise unlink and rebind each other's socket file.
+#define HANDOFF_PATH_ENV "HTTP_SERVER_HANDOFF"
+#define HANDOFF_DRAIN_SECONDS 10
+#define HANDOFF_BACKLOG 1
+#define HANDOFF_ERROR -1
+#define HANDOFF_FAILED -2
+#define HANDOFF_RETRY -3
+#define HANDOFF_RETRY_NANOSECONDS 100000000
+// Shorter than HANDOFF_DRAIN_SECONDS so a waiting successor is answered in time
+#define CLIENT_TIMEOUT_SECONDS 2
+#define DRAIN_DEADLINE_MESSAGE "Drain deadline reached, dropping in-flight responses\n"
+#define POLL_FOREVER -1
+#define LISTENER_POLL_INDEX 0
+#define HANDOFF_POLL_INDEX 1
+#define SHUTDOWN_POLL_INDEX 2
+#define POLL_COUNT 3
 static int mainSocket;
+static int handoffSocket = HANDOFF_ERROR;
+static ino_t handoffInode;
+// The SIGINT handler writes here so poll wakes up even when the signal lands
+// just before it is called
+static int shutdownPipe[2];
+static volatile sig_atomic_t stopAccepting = 0;
+
+// Defined in http_server.c
+int http_server_apply_placement();
+void http_server_check_inherited(int socket, Config config);
 
 void serverHandler()
 {
-    log_trace("server interreupteda and shutting down");
-    signal(SIGINT, serverHandler);
-    log_trace("Server is now taken down");
-    
-    exit(EXIT_SUCCESS);
+    // only async-signal-safe calls in here
+    int savedErrno = errno;
+    // let the request being served finish, but do not wait on it forever
+    stopAccepting = 1;
+    write(shutdownPipe[1], "x", 1);
+    alarm(HANDOFF_DRAIN_SECONDS);
+    errno = savedErrno;
+}
+
+void drainDeadlineHandler()
+{
+    // only async-signal-safe calls in here
+    write(STDERR_FILENO, DRAIN_DEADLINE_MESSAGE, sizeof(DRAIN_DEADLINE_MESSAGE) - 1);
+    _exit(EXIT_FAILURE);
+}
+
+// Fills addr with the unix socket path used for the listening socket handoff.
+// Returns -1 if the path does not fit.
+static int handoffAddress(const char* path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path))
+    {
+        log_error("Handoff path %s is too long", path);
+        return HANDOFF_ERROR;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// Returns 0 if nothing or a unix socket is at the handoff path, so it is safe
+// to connect to and to replace. Anything else is left alone.
+static int checkHandoffPath(const char* path)
+{
+    struct stat pathInfo;
+    if(lstat(path, &pathInfo) != 0 || S_ISSOCK(pathInfo.st_mode))
+    {
+        return 0;
+    }
+    log_error("Handoff path %s exists and is not a socket", path);
+    return HANDOFF_ERROR;
+}
+
+// Makes one attempt at taking the listening socket from a running server. The
+// socket arrives as SCM_RIGHTS ancillary data. Returns the listening socket,
+// -1 if no server is there, -2 if the handoff failed, or -3 if the server
+// closed the connection before sending because it is shutting down.
+static int requestListener(const struct sockaddr_un* addr)
+{
+    int unixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(unixSocket == HANDOFF_ERROR)
+    {
+        log_error("Could not create handoff socket: %s", strerror(errno));
+        return HANDOFF_FAILED;
+    }
+    if(connect(unixSocket, (const struct sockaddr*)addr, sizeof(*addr)) != 0)
+    {
+        int connectErrno = errno;
+        close(unixSocket);
+        // only a missing or dead socket file means nobody holds the port,
+        // anything else could hide a live server
+        if(connectErrno == ENOENT || connectErrno == ECONNREFUSED)
+        {
+            log_trace("No running server to take the socket from");
+            return HANDOFF_ERROR;
+        }
+        log_error("Could not reach the old server: %s", strerror(connectErrno));
+        return HANDOFF_FAILED;
+    }
+
+    // the old server answers between requests, which takes at most this long
+    struct timeval handoffTimeout = {.tv_sec = HANDOFF_DRAIN_SECONDS};
+    if(setsockopt(unixSocket, SOL_SOCKET, SO_RCVTIMEO, &handoffTimeout, sizeof(handoffTimeout)) != 0)
+    {
+        log_error("Could not set handoff timeout: %s", strerror(errno));
+        close(unixSocket);
+        return HANDOFF_FAILED;
+    }
+
+    char data;
+    struct iovec iov = {.iov_base = &data, .iov_len = sizeof(data)};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(unixSocket, &msg, 0);
+    int receiveErrno = errno;
+    close(unixSocket);
+    if(received < 0 && (receiveErrno == EAGAIN || receiveErrno == EWOULDBLOCK))
+    {
+        log_error("Old server did not hand over within %d seconds", HANDOFF_DRAIN_SECONDS);
+        return HANDOFF_FAILED;
+    }
+    if(received < 0 && receiveErrno != ECONNRESET)
+    {
+        log_error("Handoff receive failed: %s", strerror(receiveErrno));
+        return HANDOFF_FAILED;
+    }
+    // closing the handoff socket with us still in its backlog resets us
+    if(received <= 0)
+    {
+        log_trace("Old server closed the handoff without sending a socket");
+        return HANDOFF_RETRY;
+    }
+    if(msg.msg_flags & MSG_CTRUNC)
+    {
+        log_error("Handoff control data was truncated");
+        return HANDOFF_FAILED;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+    {
+        log_error("Old server answered without sending a socket");
+        return HANDOFF_FAILED;
+    }
+    int listener;
+    memcpy(&listener, CMSG_DATA(cmsg), sizeof(int));
+
+    // make sure we got a listening TCP socket and not some other fd
+    int accepting = 0;
+    int type = 0;
+    socklen_t optionLength = sizeof(accepting);
+    if(getsockopt(listener, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &optionLength) != 0 || !accepting)
+    {
+        log_error("Handed over socket is not listening");
+        close(listener);
+        return HANDOFF_FAILED;
+    }
+    optionLength = sizeof(type);
+    if(getsockopt(listener, SOL_SOCKET, SO_TYPE, &type, &optionLength) != 0 || type != SOCK_STREAM)
+    {
+        log_error("Handed over socket is not a TCP socket");
+        close(listener);
+        return HANDOFF_FAILED;
+    }
+
+    log_info("Took over listening socket from the old server");
+    return listener;
+}
+
+// Asks a running server for its listening socket over the handoff path.
+// Returns the listening socket, -1 if no old server is running, or -2 if one
+// is running but the handoff failed. A server that is shutting down closes
+// the connection without sending, so that is retried until it is gone.
+static int receiveListener(const char* path)
+{
+    struct sockaddr_un addr;
+    if(handoffAddress(path, &addr) != 0 || checkHandoffPath(path) != 0)
+    {
+        return HANDOFF_FAILED;
+    }
+
+    time_t deadline = time(NULL) + HANDOFF_DRAIN_SECONDS;
+    struct timespec retryDelay = {.tv_nsec = HANDOFF_RETRY_NANOSECONDS};
+    while(1)
+    {
+        int result = requestListener(&addr);
+        if(result != HANDOFF_RETRY)
+        {
+            return result;
+        }
+        if(time(NULL) >= deadline)
+        {
+            log_error("Old server kept closing the handoff for %d seconds", HANDOFF_DRAIN_SECONDS);
+            return HANDOFF_FAILED;
+        }
+        nanosleep(&retryDelay, NULL);
+    }
+}
+
+// Sends the listening socket to the new server that connected on the handoff
+// socket. After this the old server must stop accepting.
+static int sendListener(int listener)
+{
+    int newServer = accept(handoffSocket, NULL, NULL);
+    if(newServer == HANDOFF_ERROR)
+    {
+        log_error("Handoff accept failed: %s", strerror(errno));
+        return HANDOFF_ERROR;
+    }
+
+    char data = 'L';
+    struct iovec iov = {.iov_base = &data, .iov_len = sizeof(data)};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listener, sizeof(int));
+
+    int status = sendmsg(newServer, &msg, 0) == sizeof(data) ? 0 : HANDOFF_ERROR;
+    if(status != 0)
+    {
+        log_error("Handoff send failed: %s", strerror(errno));
+    }
+    close(newServer);
+    return status;
+}
+
+// Opens the unix socket a future server connects to for the handoff. Any
+// socket file left at the path belongs to the server we just took over from,
+// which no longer listens on it.
+static int openHandoffSocket(const char* path)
+{
+    struct sockaddr_un addr;
+    if(handoffAddress(path, &addr) != 0 || checkHandoffPath(path) != 0)
+    {
+        return HANDOFF_ERROR;
+    }
+
+    int unixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(unixSocket == HANDOFF_ERROR)
+    {
+        return HANDOFF_ERROR;
+    }
+    unlink(path);
+    struct stat socketFile;
+    if(bind(unixSocket, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(unixSocket, HANDOFF_BACKLOG) != 0 || stat(path, &socketFile) != 0)
+    {
+        log_error("Could not open handoff socket %s: %s", path, strerror(errno));
+        close(unixSocket);
+        return HANDOFF_ERROR;
+    }
+    // remembered so shutdown never unlinks a file a newer server bound
+    handoffInode = socketFile.st_ino;
+    return unixSocket;
 }
 
 
@@ -31,18 +297,97 @@ int main(int argc, char* argv[])
         return EXIT_SUCCESS;
     }
     
-    mainSocket = http_server_create(mainConfig);
+    if(http_server_apply_placement() != 0)
+    {
+        return EXIT_FAILURE;
+    }
 
-    if(mainSocket == HTTP_SERVER_BAD_SOCKET)
+    const char* handoffPath = getenv(HANDOFF_PATH_ENV);
+    mainSocket = HANDOFF_ERROR;
+    if(handoffPath != NULL)
+    {
+        mainSocket = receiveListener(handoffPath);
+    }
+    if(mainSocket == HANDOFF_FAILED)
+    {
+        // an old server is still around, binding again would collide with it
+        log_error("Hot restart failed, not starting a second listener");
+        return EXIT_FAILURE;
+    }
+    if(mainSocket == HANDOFF_ERROR)
+    {
+        mainSocket = http_server_create(mainConfig);
+    }
+    else
+    {
+        http_server_check_inherited(mainSocket, mainConfig);
+    }
+
+    // http_server_create reports errors with several negative codes
+    if(mainSocket < 0)
     {
         
         return EXIT_FAILURE;
     }
 
+    if(handoffPath != NULL)
+    {
+        handoffSocket = openHandoffSocket(handoffPath);
+    }
+
+    if(pipe(shutdownPipe) != 0 || fcntl(shutdownPipe[1], F_SETFL, O_NONBLOCK) != 0)
+    {
+        log_error("Could not create shutdown pipe: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
     signal(SIGINT, serverHandler);
+    signal(SIGALRM, drainDeadlineHandler);
 
-    while(1)
+    struct pollfd listeners[POLL_COUNT];
+    listeners[LISTENER_POLL_INDEX].fd = mainSocket;
+    listeners[LISTENER_POLL_INDEX].events = POLLIN;
+    listeners[HANDOFF_POLL_INDEX].fd = handoffSocket;
+    listeners[HANDOFF_POLL_INDEX].events = POLLIN;
+    listeners[SHUTDOWN_POLL_INDEX].fd = shutdownPipe[0];
+    listeners[SHUTDOWN_POLL_INDEX].events = POLLIN;
+
+    while(!stopAccepting)
     {
+        // a negative fd is skipped by poll, so this works without a handoff socket
+        if(poll(listeners, POLL_COUNT, POLL_FOREVER) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            log_error("Polling the listeners failed: %s", strerror(errno));
+            break;
+        }
+
+        if(stopAccepting)
+        {
+            break;
+        }
+
+        if(listeners[HANDOFF_POLL_INDEX].revents & POLLIN)
+        {
+            if(sendListener(mainSocket) == 0)
+            {
+                // the new server owns the socket file now, so do not unlink it
+                log_info("Listening socket handed over, no longer accepting");
+                close(handoffSocket);
+                handoffSocket = HANDOFF_ERROR;
+                break;
+            }
+            continue;
+        }
+
+        if(!(listeners[LISTENER_POLL_INDEX].revents & POLLIN))
+        {
+            continue;
+        }
+
         int clientSocket = http_server_accept(mainSocket);
 
         if(clientSocket == HTTP_SERVER_BAD_SOCKET)
@@ -50,8 +395,24 @@ int main(int argc, char* argv[])
             continue;
         }
 
+        // a successor only waits HANDOFF_DRAIN_SECONDS for the socket, so an
+        // idle client must not hold this loop in recv past that
+        if(handoffSocket != HANDOFF_ERROR)
+        {
+            struct timeval clientTimeout = {.tv_sec = CLIENT_TIMEOUT_SECONDS};
+            setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &clientTimeout, sizeof(clientTimeout));
+        }
+
         Request newRequest = http_server_receive_request(clientSocket);
 
+        if(newRequest.method == NULL)
+        {
+            // the client timed out or sent nothing usable, there is nothing to answer
+            Response emptyResponse = {0};
+            http_server_client_cleanup(clientSocket, newRequest, emptyResponse);
+            continue;
+        }
+
         Response newResponse = http_server_process_request(newRequest, mainConfig.relative_path);
 
         if(newResponse.status == NULL && newResponse.file == NULL && newResponse.num_headers == -404 && newResponse.headers == NULL)
@@ -71,7 +432,29 @@ int main(int argc, char* argv[])
         http_server_client_cleanup(clientSocket, newRequest, newResponse);
 
     }
+    if(handoffSocket != HANDOFF_ERROR)
+    {
+        // a new server may have connected while the last request drained
+        struct pollfd successor = {.fd = handoffSocket, .events = POLLIN};
+        if(poll(&successor, 1, 0) > 0 && sendListener(mainSocket) == 0)
+        {
+            log_info("Listening socket handed over during shutdown");
+            close(handoffSocket);
+            handoffSocket = HANDOFF_ERROR;
+        }
+    }
+    // the listener goes first, so a server that connects from here on and is
+    // refused can bind the port itself
     http_server_cleanup(mainSocket);
+    if(handoffSocket != HANDOFF_ERROR)
+    {
+        close(handoffSocket);
+        struct stat socketFile;
+        if(stat(handoffPath, &socketFile) == 0 && socketFile.st_ino == handoffInode)
+        {
+            unlink(handoffPath);
+        }
+    }
     return EXIT_SUCCESS;
 
 